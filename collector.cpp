@@ -0,0 +1,275 @@
+// structlog_collector: 读取本机所有进程的共享内存日志 ring (见 structlog/shmring.h) 并负责落盘/切分/压缩
+//
+// usage: structlog_collector <path> [-s max_bytes] [-z] [-i index_records] [-b index_bytes]
+//   path       输出文件, 以追加方式打开
+//   -s         文件超过 max_bytes 后切分为 path.<unix time>-<seq>, 默认 1 GiB, 0 表示不切分
+//   -z         切分后用 gzip 压缩旧文件, 时间索引针对未压缩的文件, 压缩后不再可用
+//   -i/-b      每 index_records 条日志或 index_bytes 字节生成一条时间索引 path.idx (见 structlog/timeindex.h), 默认不生成
+//
+// 每条日志会加上生产者的 pid 字段: {"pid":1234,...}
+// 生产者退出且 ring 读完后删除其共享内存
+// ring 只允许单个消费者, 同一时间只能运行一个 collector, 已有 collector 在运行时以错误退出
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <chrono>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "structlog/number.h"
+#include "structlog/shmring.h"
+#include "structlog/timeindex.h"
+
+namespace {
+
+volatile std::sig_atomic_t g_stop = 0;
+
+// shared by every collector on the host since the rings are, deliberately outside the ring name prefix
+const char kLockPath[] = "/dev/shm/structlog-collector.lock";
+
+void OnSignal(int) {
+  g_stop = 1;
+}
+
+class RotatingFile {
+ public:
+  RotatingFile(const std::string& path, uint64_t max_bytes, bool gzip, std::size_t index_records,
+               std::size_t index_bytes)
+    : path_(path)
+    , max_bytes_(max_bytes)
+    , gzip_(gzip)
+    , index_records_(index_records)
+    , index_bytes_(index_bytes)
+    , seq_(0)
+    , size_(0)
+    , f_(nullptr) {}
+  ~RotatingFile() {
+    if (f_)
+      fclose(f_);
+  }
+  bool Open() {
+    f_ = fopen(path_.c_str(), "ab");
+    if (!f_)
+      return false;
+    fseek(f_, 0, SEEK_END);
+    size_ = static_cast<uint64_t>(ftell(f_));
+    if ((index_records_ || index_bytes_) && !index_.Open(path_, size_, index_records_, index_bytes_))
+      return false;
+    return true;
+  }
+  uint64_t size() const { return size_; }
+  // called after writing a record that started at offset
+  void Index(uint64_t time, uint64_t offset) {
+    if (index_.is_open())
+      index_.Add(time, offset, size_ - offset);
+  }
+  void Write(const char* data, std::size_t n) {
+    fwrite(data, 1, n, f_);
+    size_ += n;
+  }
+  // only rotate between drains, so that records never straddle two files
+  void Flush() {
+    fflush(f_);
+    if (max_bytes_ && size_ >= max_bytes_)
+      Rotate();
+  }
+
+ private:
+  void Rotate() {
+    fclose(f_);
+    f_ = nullptr;
+    std::string rotated = path_ + "." + std::to_string(time(nullptr)) + "-" + std::to_string(seq_++);
+    if (index_.is_open()) {
+      index_.Close();
+      rename(structlog::TimeIndexPath(path_).c_str(), structlog::TimeIndexPath(rotated).c_str());
+    }
+    if (rename(path_.c_str(), rotated.c_str()) == 0 && gzip_ && fork() == 0) {
+      execlp("gzip", "gzip", "-f", rotated.c_str(), static_cast<char*>(nullptr));
+      _exit(127);
+    }
+    if (!Open()) {
+      fprintf(stderr, "structlog_collector: reopen %s: %s\n", path_.c_str(), strerror(errno));
+      exit(1);
+    }
+  }
+
+  std::string path_;
+  uint64_t max_bytes_;
+  bool gzip_;
+  std::size_t index_records_;
+  std::size_t index_bytes_;
+  structlog::TimeIndexWriter index_;
+  uint64_t seq_;
+  uint64_t size_;
+  FILE* f_;
+};
+
+using Producers = std::map<std::string, std::unique_ptr<structlog::ShmRing>>;
+
+// a reused pid belongs to a process with a different start time
+bool ProducerAlive(const structlog::ShmRing& ring) {
+  pid_t pid = static_cast<pid_t>(ring.pid());
+  if (kill(pid, 0) != 0 && errno == ESRCH)
+    return false;
+  return !ring.start_time() || structlog::ShmRing::ProcessStartTime(pid) == ring.start_time();
+}
+
+// attach to rings that showed up since last scan
+void Scan(Producers& producers) {
+  DIR* dir = opendir("/dev/shm");
+  if (!dir)
+    return;
+  const std::size_t prefix_len = strlen(structlog::ShmRing::kPrefix);
+  while (struct dirent* e = readdir(dir)) {
+    if (strncmp(e->d_name, structlog::ShmRing::kPrefix, prefix_len) != 0 || producers.count(e->d_name))
+      continue;
+    std::unique_ptr<structlog::ShmRing> ring(new structlog::ShmRing());
+    // not initialized yet, try again on next scan
+    if (!ring->Open(e->d_name))
+      continue;
+    producers[e->d_name] = std::move(ring);
+  }
+  closedir(dir);
+}
+
+// prefix every line of payload with the producer pid
+void WriteRecord(RotatingFile& out, uint32_t pid, uint64_t time, const char* data, std::size_t n) {
+  char prefix[32] = R"({"pid":)";
+  char digits[24];
+  char* end = digits + sizeof(digits);
+  char* pos = structlog::IntegerFmt(end, pid, false);
+  std::size_t len = std::copy(pos, end, prefix + 7) - prefix;
+  prefix[len++] = ',';
+  const char* eod = data + n;
+  while (data < eod) {
+    const char* eol = static_cast<const char*>(memchr(data, '\n', eod - data));
+    eol = eol ? eol + 1 : eod;
+    uint64_t offset = out.size();
+    if (*data == '{' && eol - data > 3) {
+      out.Write(prefix, len);
+      out.Write(data + 1, eol - data - 1);
+    } else {
+      out.Write(data, eol - data);
+    }
+    out.Index(time, offset);
+    data = eol;
+  }
+}
+
+std::size_t Drain(Producers& producers, RotatingFile& out) {
+  std::size_t count = 0;
+  for (auto& p : producers) {
+    count += p.second->Read([&](uint32_t pid, uint64_t time, const char* data, std::size_t n) {
+      WriteRecord(out, pid, time, data, n);
+    });
+    if (uint64_t dropped = p.second->TakeDropped()) {
+      std::string msg = R"({"pid":)" + std::to_string(p.second->pid()) +
+                        R"(,"level":"warning","msg":"structlog ring overflow","dropped":)" + std::to_string(dropped) +
+                        "}\n";
+      out.Write(msg.data(), msg.size());
+    }
+  }
+  return count;
+}
+
+// hand the space of everything drained back to the producers, only after it reached the file
+void Release(Producers& producers) {
+  for (auto& p : producers)
+    p.second->Release();
+}
+
+// forget rings whose producer has exited, after everything committed has been written out
+void Reap(Producers& producers, RotatingFile& out) {
+  for (auto it = producers.begin(); it != producers.end();) {
+    if (ProducerAlive(*it->second)) {
+      ++it;
+      continue;
+    }
+    // the producer may have written more since the last drain, a record it died in the middle of is lost
+    it->second->Read([&](uint32_t pid, uint64_t time, const char* data, std::size_t n) {
+      WriteRecord(out, pid, time, data, n);
+    });
+    out.Flush();
+    shm_unlink(("/" + it->first).c_str());
+    it = producers.erase(it);
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  uint64_t max_bytes = uint64_t(1) << 30;
+  bool gzip = false;
+  std::size_t index_records = 0, index_bytes = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:zi:b:")) != -1) {
+    switch (opt) {
+      case 's':
+        max_bytes = strtoull(optarg, nullptr, 10);
+        break;
+      case 'z':
+        gzip = true;
+        break;
+      case 'i':
+        index_records = strtoull(optarg, nullptr, 10);
+        break;
+      case 'b':
+        index_bytes = strtoull(optarg, nullptr, 10);
+        break;
+      default:
+        fprintf(stderr, "usage: %s <path> [-s max_bytes] [-z] [-i index_records] [-b index_bytes]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (optind >= argc) {
+    fprintf(stderr, "usage: %s <path> [-s max_bytes] [-z] [-i index_records] [-b index_bytes]\n", argv[0]);
+    return 2;
+  }
+  // held until exit, the kernel releases it even if the collector crashes
+  int lock_fd = open(kLockPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    fprintf(stderr, "structlog_collector: lock %s: %s\n", kLockPath,
+            errno == EWOULDBLOCK ? "another collector is running" : strerror(errno));
+    return 1;
+  }
+  RotatingFile out(argv[optind], max_bytes, gzip, index_records, index_bytes);
+  if (!out.Open()) {
+    fprintf(stderr, "structlog_collector: open %s: %s\n", argv[optind], strerror(errno));
+    return 1;
+  }
+  signal(SIGINT, OnSignal);
+  signal(SIGTERM, OnSignal);
+  signal(SIGCHLD, SIG_IGN);  // reap gzip children automatically
+
+  Producers producers;
+  auto next_scan = std::chrono::steady_clock::now();
+  while (!g_stop) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= next_scan) {
+      Reap(producers, out);
+      Scan(producers);
+      next_scan = now + std::chrono::seconds(1);
+    }
+    std::size_t count = Drain(producers, out);
+    out.Flush();
+    Release(producers);
+    if (!count)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  Drain(producers, out);
+  out.Flush();
+  Release(producers);
+  return 0;
+}
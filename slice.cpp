@@ -0,0 +1,25 @@
+// structlog_slice: 借助时间索引 (见 structlog/timeindex.h) 输出日志文件中某个时间段内的日志
+//
+// usage: structlog_slice <path> <begin> <end>
+//   begin/end  与日志 time 字段相同的格式, 例如 2022-04-26T10:31:05 或 2022-04-26T10:31:05.5+08:00, 闭区间
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include "structlog/timeindex.h"
+
+int main(int argc, char* argv[]) {
+  if (argc != 4) {
+    fprintf(stderr, "usage: %s <path> <begin> <end>\n", argv[0]);
+    return 2;
+  }
+  uint64_t begin, end;
+  if (!structlog::ParseTime(argv[2], strlen(argv[2]), begin) || !structlog::ParseTime(argv[3], strlen(argv[3]), end)) {
+    fprintf(stderr, "structlog_slice: invalid time, expect 2022-04-26T10:31:05[.nnnnnnnnn][+08:00]\n");
+    return 2;
+  }
+  std::ios::sync_with_stdio(false);
+  structlog::CopyTimeRange(argv[1], begin, end, std::cout);
+  std::cout.flush();
+  return 0;
+}
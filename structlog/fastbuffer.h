@@ -15,12 +15,13 @@ class FastBuffer
 public:
     FastBuffer() : r_(0), cap_(0), end_(nullptr) {}
     FastBuffer(const FastBuffer& b) : r_(b.end_ - b.get()), cap_(r_), b_(new char[r_]), end_(std::copy_n(b.get(), r_, b_.get())) {}
+    FastBuffer(const char* s, std::size_t n) : r_(n), cap_(n), b_(new char[n]), end_(std::copy_n(s, n, b_.get())) {}
     // non null terminated
     const char* get() const
     {
         return b_.get();
     }
-    std::size_t size()
+    std::size_t size() const
     {
         return static_cast<std::size_t>(end_ - get());
     }
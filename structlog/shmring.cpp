@@ -0,0 +1,152 @@
+#include "structlog/shmring.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace structlog {
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory ring requires address-free atomics");
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared memory ring requires address-free atomics");
+static_assert(sizeof(ShmRecord) % 8 == 0, "records must keep 8 byte alignment");
+
+static const std::size_t kHeaderSize = (sizeof(ShmRingHeader) + 4095) & ~std::size_t(4095);
+
+static uint64_t Align8(uint64_t n) {
+  return (n + 7) & ~uint64_t(7);
+}
+
+uint64_t ShmRing::ProcessStartTime(pid_t pid) {
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/%d/stat", static_cast<int>(pid));
+  FILE* f = fopen(path, "r");
+  if (!f)
+    return 0;
+  char buf[1024];
+  std::size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+  fclose(f);
+  buf[n] = '\0';
+  // the command name may contain spaces and parentheses, fields are counted from the last ')'
+  const char* p = strrchr(buf, ')');
+  // a zombie has exited and will never write again
+  if (!p || p[1] != ' ' || p[2] == 'Z')
+    return 0;
+  // the ')' ends field 2, starttime is field 22
+  for (int field = 3; field <= 22 && p; field++)
+    p = strchr(p + 1, ' ');
+  return p ? strtoull(p + 1, nullptr, 10) : 0;
+}
+
+ShmRing::~ShmRing() {
+  if (header_)
+    munmap(header_, map_size_);
+}
+
+bool ShmRing::Create(pid_t pid, std::size_t capacity) {
+  std::size_t cap = 4096;
+  while (cap < capacity)
+    cap <<= 1;
+  // a ring left by an earlier process with the same pid may still hold records the collector has not read yet,
+  // never reuse its name
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  std::string name = "/" + std::string(kPrefix) + std::to_string(pid) + "." +
+                     std::to_string(uint64_t(ts.tv_sec) * 1000000000 + uint64_t(ts.tv_nsec));
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+  if (fd < 0)
+    return false;
+  std::size_t size = kHeaderSize + cap;
+  if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+    close(fd);
+    shm_unlink(name.c_str());
+    return false;
+  }
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    return false;
+  }
+  // ftruncate zero fills the region, zero never matches a commit tag
+  header_ = new (p) ShmRingHeader();
+  header_->capacity = cap;
+  header_->pid = static_cast<uint32_t>(pid);
+  header_->start_time = ProcessStartTime(pid);
+  header_->write.store(0, std::memory_order_relaxed);
+  header_->read.store(0, std::memory_order_relaxed);
+  header_->dropped.store(0, std::memory_order_relaxed);
+  header_->reported = 0;
+  header_->magic.store(kMagic, std::memory_order_release);
+  data_ = static_cast<char*>(p) + kHeaderSize;
+  map_size_ = size;
+  pid_ = static_cast<uint32_t>(pid);
+  return true;
+}
+
+bool ShmRing::Open(const std::string& name) {
+  int fd = shm_open(("/" + name).c_str(), O_RDWR, 0);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) <= kHeaderSize) {
+    close(fd);
+    return false;
+  }
+  std::size_t size = static_cast<std::size_t>(st.st_size);
+  void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED)
+    return false;
+  auto header = static_cast<ShmRingHeader*>(p);
+  if (header->magic.load(std::memory_order_acquire) != kMagic || kHeaderSize + header->capacity != size) {
+    munmap(p, size);
+    return false;
+  }
+  header_ = header;
+  data_ = static_cast<char*>(p) + kHeaderSize;
+  map_size_ = size;
+  pid_ = header->pid;
+  cursor_ = header->read.load(std::memory_order_acquire);
+  return true;
+}
+
+bool ShmRing::Write(const char* data, std::size_t n, uint64_t time, std::size_t records) {
+  const uint64_t cap = header_->capacity;
+  const uint64_t len = Align8(sizeof(ShmRecord) + n);
+  // a record must never take more than half of the ring, otherwise a single burst starves everyone else
+  if (len > cap / 2) {
+    header_->dropped.fetch_add(records, std::memory_order_relaxed);
+    return false;
+  }
+  uint64_t w = header_->write.load(std::memory_order_relaxed);
+  uint64_t pad;
+  do {
+    uint64_t off = w & (cap - 1);
+    pad = off + len > cap ? cap - off : 0;
+    if (w + pad + len - header_->read.load(std::memory_order_acquire) > cap) {
+      header_->dropped.fetch_add(records, std::memory_order_relaxed);
+      return false;
+    }
+  } while (!header_->write.compare_exchange_weak(w, w + pad + len, std::memory_order_relaxed));
+  if (pad) {
+    // pad is at least 8 bytes since records are 8 byte aligned, enough for the commit word
+    ShmRecord* skip = At(w);
+    skip->commit.store(w ^ ShmRecord::kPadding, std::memory_order_release);
+  }
+  ShmRecord* rec = At(w + pad);
+  rec->len = static_cast<uint32_t>(len);
+  rec->size = static_cast<uint32_t>(n);
+  rec->pid = pid_;
+  rec->time = time;
+  std::memcpy(reinterpret_cast<char*>(rec) + sizeof(ShmRecord), data, n);
+  rec->commit.store((w + pad) ^ ShmRecord::kCommitted, std::memory_order_release);
+  return true;
+}
+
+}  // namespace structlog
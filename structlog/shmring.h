@@ -0,0 +1,123 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+/*
+进程间共享内存日志 ring, 每个生产者进程创建一个 /dev/shm/structlog.<pid>.<创建时间>, 由 structlog_collector 负责读取并落盘
+名字中带有创建时间, pid 被复用时新进程不会覆盖旧进程尚未读完的 ring
+
+布局: ShmRingHeader 之后是 capacity 字节的数据区, 数据区由连续的 ShmRecord 组成, 每条记录按 8 字节对齐
+生产者(同一进程内的多个线程)用 CAS 在 write 上预留空间, 写入 payload 后再以 release 语义写入 commit 完成提交
+commit 的值由记录的位置决定, 因此上一圈残留的数据不会被误认为已提交, 消费者读取后无需清零
+消费者(collector, 单个)按顺序读取已提交的记录, 在读取的数据落盘后再调用 Release 推进 read
+collector 在 Release 之前崩溃时 read 不变, 重启后会重新读取这些记录(至少一次), 不会丢失也不会卡住
+ring 满时生产者直接丢弃记录并累加 dropped, 永远不会阻塞, 因此 collector 重启期间生产者不受影响
+read/write 都保存在共享内存中, collector 重启后从上次的 read 处继续读取
+*/
+
+namespace structlog {
+
+struct ShmRingHeader {
+  std::atomic<uint64_t> magic;  // 初始化完成后才写入, collector 据此判断 ring 是否可用
+  uint64_t capacity;            // 数据区大小, 2 的幂
+  uint32_t pid;                 // 创建者 pid, collector 用于判断生产者是否已退出
+  uint32_t reserved;
+  uint64_t start_time;          // 创建者的启动时间(见 ProcessStartTime), pid 被复用时与新进程不同
+  alignas(64) std::atomic<uint64_t> write;
+  alignas(64) std::atomic<uint64_t> read;
+  alignas(64) std::atomic<uint64_t> dropped;
+  uint64_t reported;  // 只由 collector 读写, 已经报告过的丢弃条数, 避免 collector 重启后重复报告
+};
+
+struct ShmRecord {
+  // 提交后为 位置 ^ kCommitted, 填充记录(跳到数据区开头)为 位置 ^ kPadding, 其它值都表示尚未提交
+  // 填充记录只有 commit 有效
+  std::atomic<uint64_t> commit;
+  uint32_t len;   // 整条记录(含 header 及对齐)的长度
+  uint32_t size;  // payload 长度
+  uint32_t pid;
+  uint32_t reserved;
+  uint64_t time;  // 日志时间, unix 纳秒, collector 用于生成时间索引
+  static constexpr uint64_t kCommitted = 0x9e3779b97f4a7c15ull;
+  static constexpr uint64_t kPadding = 0xc2b2ae3d27d4eb4full;
+};
+
+class ShmRing {
+ public:
+  static constexpr uint64_t kMagic = 0x34474f4c54435453ull;  // "STCTLOG4"
+  static constexpr const char* kPrefix = "structlog.";
+
+  ShmRing() : header_(nullptr), data_(nullptr), map_size_(0), pid_(0), cursor_(0) {}
+  ~ShmRing();
+  ShmRing(const ShmRing&) = delete;
+  ShmRing& operator=(const ShmRing&) = delete;
+
+  // 进程的启动时间(系统启动以来的 clock tick, 读自 /proc/<pid>/stat), 进程不存在, 已退出(zombie)或无法读取时返回 0
+  static uint64_t ProcessStartTime(pid_t pid);
+
+  // 生产者: 以 pid 和当前时间命名创建 ring, capacity 会向上取整为 2 的幂, 失败返回 false
+  bool Create(pid_t pid, std::size_t capacity);
+  // 消费者: 打开一个已存在的 ring, name 为 /dev/shm 下的文件名, 未初始化完成或格式不符时返回 false
+  bool Open(const std::string& name);
+
+  // 写入一条记录, 其中包含 records 条时间为 time 的日志, 不会阻塞, 空间不足时丢弃并返回 false, dropped 按日志条数累加
+  // 长度超过 capacity 一半的记录总是被丢弃
+  // 线程安全
+  bool Write(const char* data, std::size_t n, uint64_t time, std::size_t records = 1);
+
+  // 从上次读取的位置起读取所有已提交的记录, 对每条记录调用 f(pid, time, data, size), 返回读取的记录数
+  // 读取的空间在 Release 之前不会被生产者复用
+  // 只能由单个消费者调用
+  template <typename F>
+  std::size_t Read(F&& f);
+  // 将 Read 读取过的空间交还给生产者, 应在读取的数据落盘之后调用
+  void Release() { header_->read.store(cursor_, std::memory_order_release); }
+
+  uint32_t pid() const { return header_->pid; }
+  uint64_t start_time() const { return header_->start_time; }
+  std::size_t capacity() const { return header_->capacity; }
+  // 返回上次调用以来新丢弃的记录数, 只能由单个消费者调用
+  uint64_t TakeDropped() {
+    uint64_t dropped = header_->dropped.load(std::memory_order_relaxed);
+    uint64_t n = dropped - header_->reported;
+    header_->reported = dropped;
+    return n;
+  }
+
+ private:
+  ShmRecord* At(uint64_t pos) { return reinterpret_cast<ShmRecord*>(data_ + (pos & (header_->capacity - 1))); }
+
+  ShmRingHeader* header_;
+  char* data_;
+  std::size_t map_size_;
+  uint32_t pid_;
+  uint64_t cursor_;  // 消费者已读取到的位置, 不早于 read
+};
+
+template <typename F>
+std::size_t ShmRing::Read(F&& f) {
+  std::size_t count = 0;
+  const uint64_t cap = header_->capacity;
+  uint64_t r = cursor_;
+  const uint64_t w = header_->write.load(std::memory_order_acquire);
+  while (r < w) {
+    ShmRecord* rec = At(r);
+    uint64_t commit = rec->commit.load(std::memory_order_acquire);
+    if (commit == (r ^ ShmRecord::kPadding)) {
+      r += cap - (r & (cap - 1));
+      continue;
+    }
+    if (commit != (r ^ ShmRecord::kCommitted))
+      break;  // producer is still writing this record
+    f(rec->pid, rec->time, reinterpret_cast<const char*>(rec) + sizeof(ShmRecord), rec->size);
+    count++;
+    r += rec->len;
+  }
+  cursor_ = r;
+  return count;
+}
+
+}  // namespace structlog
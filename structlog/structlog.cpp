@@ -1,31 +1,93 @@
 #include "structlog/structlog.h"
 
 #include <mutex>
+#include <atomic>
 #include <chrono>
 #include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <fstream>
+#include <memory>
+#include <unordered_map>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "structlog/number.h"
+#include "structlog/shmring.h"
+#include "structlog/timeindex.h"
 
 namespace structlog {
 
 static std::mutex g_structlog_lock;
 static std::ostream* g_structlog_out_stream = &std::cerr;
 static LogLevel g_structlog_out_level = LogLevel::Info;
+// the ring is intentionally leaked, it is never unmapped once created (not even at exit), so a writer that read the
+// pointer under the lock can keep using it
+static ShmRing* g_structlog_ring = nullptr;
+static ShmRing* g_structlog_out_ring = nullptr;
+// set in a forked child, the inherited ring still carries the parent's pid and goes away with it
+static bool g_structlog_forked = false;
+// owned by SetFileOutput, leaked at exit for the same reason as the ring, every record is flushed anyway
+static std::ofstream* g_structlog_file = nullptr;
+static TimeIndexWriter* g_structlog_index = nullptr;
+static uint64_t g_structlog_file_offset = 0;
+static std::atomic<uint64_t> g_structlog_shared_id(1);
+// a Batch flushes itself before growing past this, so that it always fits in one ring record
+static std::atomic<std::size_t> g_structlog_batch_bytes(Batch::kFlushBytes);
+// per thread copies of shared loggers kept before idle ones are dropped
+static const std::size_t kMaxScratches = 16;
 
 structlog::Logger& Logger::Root() {
-  static Logger root_logger(&g_structlog_lock, &g_structlog_out_stream, &g_structlog_out_level);
+  static Logger root_logger = Logger(&g_structlog_lock, &g_structlog_out_stream, &g_structlog_out_level).Shared();
   return root_logger;
 }
 
 // NRVO
 Logger Logger::Clone() {
-  Logger l(fields_, m_lock, m_out_stream, m_out_level);
+  if (shared_id_)
+    return Scratch().Clone();
+  std::size_t begin = RecordBegin();
+  Logger l(FastBuffer(fields_.get() + begin, fields_.size() - begin), m_lock, m_out_stream, m_out_level);
   fields_.shrink(fields_.size() - index_);
   return l;
 }
 
+Logger Logger::Shared() {
+  Logger l = Clone();
+  l.shared_id_ = g_structlog_shared_id.fetch_add(1, std::memory_order_relaxed);
+  return l;
+}
+
+Logger& Logger::Scratch() {
+  // the shared logger is only ever read, each thread keeps the temporary fields of every shared logger it uses in a
+  // copy of its own, so a shared logger used while evaluating the arguments of another one does not disturb it
+  static thread_local uint64_t last_id = 0;
+  static thread_local Logger* last = nullptr;
+  if (last_id == shared_id_)
+    return *last;
+  static thread_local std::unordered_map<uint64_t, std::unique_ptr<Logger>> scratches;
+  auto& scratch = scratches[shared_id_];
+  if (!scratch) {
+    // forget copies without pending fields, nothing can still be chaining on them
+    if (scratches.size() > kMaxScratches) {
+      for (auto it = scratches.begin(); it != scratches.end();) {
+        if (it->second && it->second->fields_.size() == it->second->index_)
+          it = scratches.erase(it);
+        else
+          ++it;
+      }
+    }
+    scratch.reset(new Logger(fields_, m_lock, m_out_stream, m_out_level));
+  }
+  last_id = shared_id_;
+  last = scratch.get();
+  return *scratch;
+}
+
 Logger::Logger(std::mutex* _lock, std::ostream** _out_stream, LogLevel* _out_level)
   : index_(1)
+  , shared_id_(0)
+  , batch_(nullptr)
   , m_lock(_lock)
   , m_out_stream(_out_stream)
   , m_out_level(_out_level) {
@@ -36,10 +98,21 @@ Logger::Logger(std::mutex* _lock, std::ostream** _out_stream, LogLevel* _out_lev
 Logger::Logger(const FastBuffer& fields, std::mutex* _lock, std::ostream** _out_stream, LogLevel* _out_level)
   : fields_(fields)
   , index_(fields_.size())
+  , shared_id_(0)
+  , batch_(nullptr)
   , m_lock(_lock)
   , m_out_stream(_out_stream)
   , m_out_level(_out_level) {}
 
+Logger::Logger(const Logger& l)
+  : fields_(l.fields_.get() + l.RecordBegin(), l.fields_.size() - l.RecordBegin())
+  , index_(l.index_ - l.RecordBegin())
+  , shared_id_(l.shared_id_)
+  , batch_(nullptr)
+  , m_lock(l.m_lock)
+  , m_out_stream(l.m_out_stream)
+  , m_out_level(l.m_out_level) {}
+
 template <>
 void Logger::Append(const int64_t& v) {
   Int64Fmt(fields_, v);
@@ -179,26 +252,203 @@ void Logger::Append(const std::chrono::time_point<std::chrono::system_clock>& v)
   bg.consume(data - bg.data());
 }
 
+// holding the lock across fork keeps it consistent in the child, which then replaces the parent's ring on next use
+static void ForkPrepare() {
+  g_structlog_lock.lock();
+}
+
+static void ForkParent() {
+  g_structlog_lock.unlock();
+}
+
+static void ForkChild() {
+  g_structlog_forked = true;
+  g_structlog_lock.unlock();
+}
+
+// must be called with g_structlog_lock held
+static void RenewRingAfterFork() {
+  g_structlog_forked = false;
+  if (!g_structlog_ring)
+    return;
+  // no other thread survived the fork, nobody else can still be using the parent's ring
+  std::unique_ptr<ShmRing> parent(g_structlog_ring);
+  std::unique_ptr<ShmRing> ring(new ShmRing());
+  bool out = g_structlog_out_ring != nullptr;
+  g_structlog_ring = g_structlog_out_ring = nullptr;
+  if (!ring->Create(getpid(), parent->capacity()))
+    return;  // fall back to the stream output
+  g_structlog_ring = ring.release();
+  if (out)
+    g_structlog_out_ring = g_structlog_ring;
+}
+
+// writes records that already passed the level check, must be called with g_structlog_lock held
+// returns the ring if shared memory output is on, the caller writes to it after releasing the lock
+static ShmRing* WriteLocked(std::ostream* out, const char* data, std::size_t n, uint64_t time, std::size_t records) {
+  if (g_structlog_forked)
+    RenewRingAfterFork();
+  if (g_structlog_out_ring)
+    return g_structlog_out_ring;
+  if (out) {
+    if (g_structlog_index) {
+      g_structlog_index->Add(time, g_structlog_file_offset, n, records);
+      g_structlog_file_offset += n;
+    }
+    out->write(data, n);
+    out->flush();
+  }
+  return nullptr;
+}
+
 void Logger::Emit(const LogLevel level) {
-  With("time", std::chrono::system_clock::now());
+  if (batch_) {
+    batch_->Collect(level);
+    return;
+  }
+  auto now = std::chrono::system_clock::now();
+  uint64_t time = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+  With("time", now);
   auto bg = FastBufferGuard(fields_, 2);
   fields_.shrink(1);
   bg.append("}\n");
+  ShmRing* ring = nullptr;
   {
     std::lock_guard<std::mutex> lg(*m_lock);
-    if (*m_out_stream && level <= *m_out_level) {
-      (*m_out_stream)->write(fields_.get(), fields_.size());
-      (*m_out_stream)->flush();
-    }
+    if (level <= *m_out_level)
+      ring = WriteLocked(*m_out_stream, fields_.get(), fields_.size(), time, 1);
   }
+  // lock free, the collector does the file I/O
+  if (ring)
+    ring->Write(fields_.get(), fields_.size(), time);
   fields_.shrink(fields_.size() - index_);
 }
 
+std::size_t Logger::RecordBegin() const {
+  return batch_ ? batch_->committed_ : 0;
+}
+
+Batch::Batch(Logger& logger)
+  : Logger(logger.Clone()), context_(fields_), time_ns_(0), level_(LogLevel::Panic), committed_(0), records_(0) {
+  batch_ = this;
+}
+
+void Batch::Start() {
+  // read the clock and format the time field once, every record until the next flush shares them
+  auto now = std::chrono::system_clock::now();
+  time_ns_ = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+  std::size_t n = fields_.size();
+  With("time", now);
+  auto bg = FastBufferGuard(time_, fields_.size() - n - 1);
+  bg.append(fields_.get() + n, fields_.size() - n - 1);
+  fields_.shrink(fields_.size() - n);
+  std::lock_guard<std::mutex> lg(*m_lock);
+  level_ = *m_out_level;
+}
+
+void Batch::Collect(const LogLevel level) {
+  // the time field takes at most 45 bytes
+  if (committed_ && fields_.size() + 48 > g_structlog_batch_bytes.load(std::memory_order_relaxed))
+    Flush();
+  if (!time_.size())
+    Start();
+  if (level > level_) {
+    fields_.shrink(fields_.size() - index_);
+    return;
+  }
+  // the record was formatted in place right after the previous one, close it and open the next
+  auto bg = FastBufferGuard(fields_, time_.size() + 2 + context_.size());
+  bg.append(time_.get(), time_.size());
+  bg.append("}\n");
+  committed_ = fields_.size();
+  records_++;
+  bg.append(context_.get(), context_.size());
+  index_ = fields_.size();
+}
+
+void Batch::Flush() {
+  if (committed_) {
+    ShmRing* ring = nullptr;
+    {
+      std::lock_guard<std::mutex> lg(*m_lock);
+      ring = WriteLocked(*m_out_stream, fields_.get(), committed_, time_ns_, records_);
+    }
+    // the collector splits the payload into lines and tags each of them with the pid
+    if (ring)
+      ring->Write(fields_.get(), committed_, time_ns_, records_);
+    // move the record being built to the front, the buffer already holds it so it is not reallocated
+    std::size_t pending = fields_.size() - committed_;
+    fields_.shrink(fields_.size());
+    auto bg = FastBufferGuard(fields_, pending);
+    std::memmove(bg.data(), bg.data() + committed_, pending);
+    bg.consume(pending);
+    index_ -= committed_;
+    committed_ = 0;
+    records_ = 0;
+  }
+  time_.shrink(time_.size());
+}
+
+// must be called with g_structlog_lock held
+static void CloseFileOutput() {
+  delete g_structlog_index;
+  g_structlog_index = nullptr;
+  delete g_structlog_file;
+  g_structlog_file = nullptr;
+}
+
 void SetOutput(std::ostream* out) {
   std::lock_guard<std::mutex> lg(g_structlog_lock);
+  if (out != g_structlog_file)
+    CloseFileOutput();
   g_structlog_out_stream = out;
 }
 
+bool SetFileOutput(const std::string& path, std::size_t index_records, std::size_t index_bytes) {
+  std::unique_ptr<std::ofstream> file(new std::ofstream(path, std::ios::binary | std::ios::app));
+  if (!*file)
+    return false;
+  struct stat st;
+  uint64_t offset = stat(path.c_str(), &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+  std::unique_ptr<TimeIndexWriter> index;
+  if (index_records || index_bytes) {
+    index.reset(new TimeIndexWriter());
+    if (!index->Open(path, offset, index_records, index_bytes))
+      return false;
+  }
+  std::lock_guard<std::mutex> lg(g_structlog_lock);
+  CloseFileOutput();
+  g_structlog_file = file.release();
+  g_structlog_index = index.release();
+  g_structlog_file_offset = offset;
+  g_structlog_out_stream = g_structlog_file;
+  return true;
+}
+
+bool SetShmOutput(bool enable, std::size_t capacity) {
+  std::lock_guard<std::mutex> lg(g_structlog_lock);
+  if (g_structlog_forked)
+    RenewRingAfterFork();
+  if (!enable) {
+    g_structlog_out_ring = nullptr;
+    g_structlog_batch_bytes.store(Batch::kFlushBytes, std::memory_order_relaxed);
+    return true;
+  }
+  if (!g_structlog_ring) {
+    std::unique_ptr<ShmRing> ring(new ShmRing());
+    if (!ring->Create(getpid(), capacity))
+      return false;
+    static bool registered = false;
+    if (!registered && pthread_atfork(ForkPrepare, ForkParent, ForkChild) == 0)
+      registered = true;
+    g_structlog_ring = ring.release();
+  }
+  g_structlog_out_ring = g_structlog_ring;
+  g_structlog_batch_bytes.store(std::min(Batch::kFlushBytes, g_structlog_ring->capacity() / 4),
+                                std::memory_order_relaxed);
+  return true;
+}
+
 void SetLevel(const LogLevel level) {
   std::lock_guard<std::mutex> lg(g_structlog_lock);
   g_structlog_out_level = level;
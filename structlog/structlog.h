@@ -1,5 +1,6 @@
 ﻿#pragma once
 #include <cstddef>
+#include <cstdint>
 #include <string>
 #include <mutex>
 
@@ -14,12 +15,16 @@
         StringFmt(fields_, v.to_string());
     }
 
-Logger 是有状态的，因此不能跨线程使用，需要使用 Clone 创建一个新 Logger
+Logger 是有状态的，因此不能跨线程使用，需要使用 Clone 创建一个新 Logger, 或者使用 Shared 创建一个可以跨线程共享的 Logger
 使用 Clone 创建一个新 logger, 继承了 parent 的字段，但是之后其状态和 parent 完全独立
 Clone 时会继承 parent 的上下文字段及临时字段，并将这些字段作为新 logger 的上下文字段, 并将 parent 的的临时字段清空
 Logger 内的状态包括从 parent 继承下来的上下文字段和临时的字段
 使用 With 函数将一个字段加入临时集合
 使用 Panic/Fatal/Error/Warning/Info/Debug 将输出所有字段，并将临时字段清空
+
+共享 Logger (Root 及 Shared 的返回值) 的上下文字段不可变, 对它调用 With 时临时字段写入当前线程的 thread_local 副本,
+With 返回的也是这个副本, 因此多个线程可以不加锁、不 Clone 同时使用同一个共享 Logger
+每个线程对每个共享 Logger 各有一个副本, 在同一线程中交替使用多个共享 Logger (例如在参数中调用另一个 Logger) 互不影响
 */
 
 namespace structlog {
@@ -27,10 +32,14 @@ namespace structlog {
 // 日志等级，在 SetLevel 时用到了该枚举
 enum LogLevel { Panic, Fatal, Error, Warning, Info, Debug };
 
+class Batch;
+
 class Logger {
  public:
   ~Logger() {}
-  // 返回一个全新的不带上下文信息的 Logger
+  // 拷贝上下文字段及临时字段, 拷贝出的 Logger 直接输出, 不属于任何 Batch
+  Logger(const Logger& l);
+  // 返回一个全新的不带上下文信息的共享 Logger
   // 线程安全
   static Logger& Root();
 
@@ -46,6 +55,8 @@ class Logger {
   //   shall be overwritten.
   template <typename U, typename T>
   Logger& With(const U& k, const T& v) {
+    if (shared_id_)
+      return Scratch().With(k, v);
     auto bg = FastBufferGuard(fields_, 2);
     Append(k);
     bg.append(':');
@@ -57,6 +68,9 @@ class Logger {
   // 返回一个新 Logger, 状态和之前的 Logger 完全独立
   Logger Clone();
 
+  // 返回一个新的共享 Logger, 与 Clone 一样继承上下文字段及临时字段, 之后其上下文字段不再改变, 可以同时被多个线程使用
+  Logger Shared();
+
   // 输出日志
   template <typename T>
   void Panic(const T& msg) {
@@ -105,13 +119,61 @@ class Logger {
   void Append(const char (&v)[N]) {
     StringFmt(fields_, v, N - 1);
   }
+  // 共享 Logger 在当前线程的可写副本
+  Logger& Scratch();
+  // 正在构建的日志在 fields_ 中的起始位置, 只有 Batch 不为 0
+  std::size_t RecordBegin() const;
   void Emit(const LogLevel level);
   FastBuffer fields_;
   std::size_t index_;
+  // 非 0 表示共享 Logger, 同一个共享 Logger 的拷贝具有相同的 id
+  uint64_t shared_id_;
+  // 非空时 Emit 将日志交给 Batch 缓存
+  Batch* batch_;
 
   std::mutex* m_lock;
   std::ostream** m_out_stream;
   LogLevel* m_out_level;
+
+  friend class Batch;
+};
+
+// 批量输出日志, 用于连续输出大量相关的日志, 例如行情快照、一批成交
+// 与 Clone 一样继承 logger 的上下文字段及临时字段, 之后输出的日志依次直接格式化到一块连续的缓冲区中,
+// 在 Flush 或析构时一次加锁写出并 flush, 同一批日志在输出中是连续的
+// 每次 Flush 之后的第一条日志读取一次时间和日志等级, 直到下一次 Flush 的日志都使用它们
+// 缓冲区超过 kFlushBytes 时自动 Flush, 输出到共享内存时上限为 ring 大小的 1/4, 保证一批日志总能写入一条 ring 记录
+// 不能跨线程使用
+//
+//     {
+//       structlog::Batch batch(logger);
+//       for (auto& fill : fills)
+//         batch.With("price", fill.price).With("volume", fill.volume).Info("fill");
+//     }
+class Batch : public Logger {
+ public:
+  static constexpr std::size_t kFlushBytes = 1 << 20;
+
+  explicit Batch(Logger& logger);
+  ~Batch() { Flush(); }
+  Batch(const Batch&) = delete;
+  Batch& operator=(const Batch&) = delete;
+
+  // 写出已缓存的日志
+  void Flush();
+
+ private:
+  void Start();
+  void Collect(const LogLevel level);
+  // fields_ 中 [0, committed_) 是已完成的日志, 之后是正在构建的日志
+  FastBuffer context_;  // 每条日志开头的上下文字段
+  FastBuffer time_;     // 格式化好的 "time":"..." 字段, 为空表示本次 Flush 后还未读取时间
+  uint64_t time_ns_;
+  LogLevel level_;
+  std::size_t committed_;
+  std::size_t records_;
+
+  friend class Logger;
 };
 
 // 用于输出原始 json 字符串, 会去除其中的换行
@@ -134,6 +196,21 @@ JsonRawMessage<T> make_json(const T& json) {
 // 线程安全
 void SetOutput(std::ostream* out);
 
+// 以追加方式输出到文件 path, 同时可选地维护稀疏时间索引 path.idx, 供 CopyTimeRange/structlog_slice 按时间段快速读取
+// 每 index_records 条日志或 index_bytes 字节(先到者)记录一条索引, 均为 0 时不生成索引
+// 打开失败返回 false, 输出保持不变; 之后调用 SetOutput 会关闭该文件
+// 线程安全
+bool SetFileOutput(const std::string& path, std::size_t index_records = 0, std::size_t index_bytes = 0);
+
+// 输出到共享内存 ring (/dev/shm/structlog.<pid>.<创建时间>), 由独立的 structlog_collector 进程负责落盘/压缩/切分
+// 启用后日志不再写入 SetOutput 指定的 ostream, 也不再持有锁进行文件 I/O
+// ring 满或 collector 未运行时日志会被丢弃而不会阻塞, collector 重启后从未读取处继续
+// capacity 为 ring 大小, 只在第一次启用时生效, enable 为 false 时恢复输出到 ostream
+// fork 出的子进程在第一次输出日志时创建自己的 ring, 创建失败时恢复输出到 ostream
+// 创建共享内存失败返回 false
+// 线程安全
+bool SetShmOutput(bool enable = true, std::size_t capacity = 4 << 20);
+
 // 设置日志等级，日志等级比 level 低的日志不会输出，Panic 为最高等级，Debug 为最低等级
 // 线程安全
 void SetLevel(const LogLevel level);
@@ -0,0 +1,183 @@
+#include "structlog/timeindex.h"
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+
+namespace structlog {
+
+bool TimeIndexWriter::Open(const std::string& log_path, uint64_t log_size, std::size_t every_records,
+                           std::size_t every_bytes) {
+  Close();
+  // an index reaching past the end of the log describes content that is gone, e.g. the log was truncated by
+  // copytruncate style rotation, start a new one instead of mixing old and new offsets
+  auto entries = ReadTimeIndex(log_path);
+  bool stale = !entries.empty() && entries.back().end > log_size;
+  f_ = fopen(TimeIndexPath(log_path).c_str(), stale ? "wb" : "ab");
+  if (!f_)
+    return false;
+  every_records_ = every_records ? every_records : std::numeric_limits<std::size_t>::max();
+  every_bytes_ = every_bytes ? every_bytes : std::numeric_limits<uint64_t>::max();
+  records_ = 0;
+  return true;
+}
+
+void TimeIndexWriter::Close() {
+  if (f_) {
+    if (records_)
+      Finish();
+    fclose(f_);
+    f_ = nullptr;
+  }
+}
+
+void TimeIndexWriter::Finish() {
+  // entries are rare, flush right away so that a crash only loses the interval still open
+  fwrite(&entry_, sizeof(entry_), 1, f_);
+  fflush(f_);
+  records_ = 0;
+}
+
+std::string TimeIndexPath(const std::string& log_path) {
+  return log_path + ".idx";
+}
+
+std::vector<TimeIndexEntry> ReadTimeIndex(const std::string& log_path) {
+  std::vector<TimeIndexEntry> entries;
+  FILE* f = fopen(TimeIndexPath(log_path).c_str(), "rb");
+  if (!f)
+    return entries;
+  TimeIndexEntry e;
+  while (fread(&e, sizeof(e), 1, f) == 1)
+    entries.push_back(e);
+  fclose(f);
+  return entries;
+}
+
+static bool ParseDigits(const char*& s, const char* end, std::size_t n, uint64_t& v) {
+  if (static_cast<std::size_t>(end - s) < n)
+    return false;
+  v = 0;
+  for (std::size_t i = 0; i < n; i++, s++) {
+    if (*s < '0' || *s > '9')
+      return false;
+    v = v * 10 + (*s - '0');
+  }
+  return true;
+}
+
+bool ParseTime(const char* s, std::size_t n, uint64_t& time) {
+  const char* end = s + n;
+  uint64_t y, m, d, hh, mm, ss;
+  if (!ParseDigits(s, end, 4, y) || s == end || *s++ != '-' || !ParseDigits(s, end, 2, m) || s == end ||
+      *s++ != '-' || !ParseDigits(s, end, 2, d) || s == end || *s++ != 'T' || !ParseDigits(s, end, 2, hh) ||
+      s == end || *s++ != ':' || !ParseDigits(s, end, 2, mm) || s == end || *s++ != ':' ||
+      !ParseDigits(s, end, 2, ss))
+    return false;
+  if (m < 1 || m > 12 || d < 1 || d > 31)
+    return false;
+  uint64_t ns = 0;
+  if (s < end && *s == '.') {
+    s++;
+    uint64_t scale = 1000000000;
+    while (s < end && *s >= '0' && *s <= '9') {
+      scale /= 10;
+      ns += (*s++ - '0') * scale;
+    }
+  }
+  int64_t tz = 8 * 3600;
+  if (s < end && *s == 'Z') {
+    tz = 0;
+    s++;
+  } else if (s < end && (*s == '+' || *s == '-')) {
+    bool neg = *s++ == '-';
+    uint64_t tzh, tzm;
+    if (!ParseDigits(s, end, 2, tzh) || s == end || *s++ != ':' || !ParseDigits(s, end, 2, tzm))
+      return false;
+    tz = static_cast<int64_t>(tzh * 3600 + tzm * 60) * (neg ? -1 : 1);
+  }
+  if (s != end)
+    return false;
+  // ref: https://howardhinnant.github.io/date_algorithms.html#days_from_civil
+  y -= m <= 2;
+  const uint64_t era = y / 400;
+  const uint64_t yoe = y - era * 400;                                  // [0, 399]
+  const uint64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;  // [0, 365]
+  const uint64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;          // [0, 146096]
+  const int64_t days = static_cast<int64_t>(era * 146097 + doe) - 719468;
+  const int64_t seconds = days * 86400 + static_cast<int64_t>(hh * 3600 + mm * 60 + ss) - tz;
+  if (seconds < 0)
+    return false;
+  time = static_cast<uint64_t>(seconds) * 1000000000 + ns;
+  return true;
+}
+
+// the time field is always the last one of a record, see Logger::Emit
+static bool LineTime(const std::string& line, uint64_t& time) {
+  static const char key[] = R"("time":")";
+  auto pos = line.rfind(key);
+  if (pos == std::string::npos)
+    return false;
+  pos += sizeof(key) - 1;
+  auto quote = line.find('"', pos);
+  if (quote == std::string::npos)
+    return false;
+  return ParseTime(line.data() + pos, quote - pos, time);
+}
+
+std::size_t CopyTimeRange(const std::string& log_path, uint64_t begin, uint64_t end, std::ostream& out) {
+  std::ifstream in(log_path, std::ios::binary);
+  if (!in)
+    return 0;
+  // byte ranges to read, in file order: intervals overlapping [begin, end] plus everything the index does not cover
+  std::vector<std::pair<uint64_t, uint64_t>> ranges;
+  auto read = [&ranges](uint64_t from, uint64_t to) {
+    if (from >= to)
+      return;
+    if (!ranges.empty() && ranges.back().second == from)
+      ranges.back().second = to;
+    else
+      ranges.emplace_back(from, to);
+  };
+  in.seekg(0, std::ios::end);
+  const uint64_t size = static_cast<uint64_t>(in.tellg());
+  std::vector<TimeIndexEntry> entries;
+  for (const auto& e : ReadTimeIndex(log_path)) {
+    if (e.end < e.begin || e.end > size)
+      continue;  // past the end of the log, the content it describes is gone
+    // offsets going backwards mean the log was truncated and written again, the earlier entries describe old content
+    if (!entries.empty() && e.begin < entries.back().end)
+      entries.clear();
+    entries.push_back(e);
+  }
+  uint64_t pos = 0;
+  for (const auto& e : entries) {
+    read(pos, e.begin);
+    if (e.min_time <= end && begin <= e.max_time)
+      read(e.begin, e.end);
+    pos = e.end;
+  }
+  read(pos, std::numeric_limits<uint64_t>::max());
+
+  std::size_t count = 0;
+  std::string line;
+  for (const auto& r : ranges) {
+    in.clear();
+    in.seekg(static_cast<std::streamoff>(r.first));
+    uint64_t offset = r.first;
+    while (offset < r.second && std::getline(in, line)) {
+      offset += line.size() + 1;
+      uint64_t t;
+      if (LineTime(line, t) && begin <= t && t <= end) {
+        out.write(line.data(), line.size());
+        out.put('\n');
+        count++;
+      }
+    }
+    if (!in)
+      break;  // end of file
+  }
+  return count;
+}
+
+}  // namespace structlog
@@ -0,0 +1,82 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+日志文件的稀疏时间索引, 用于按时间段快速定位日志而不必从头扫描整个文件
+
+索引文件为 <日志文件>.idx, 由连续的 TimeIndexEntry 组成(本机字节序), 每隔若干条日志或若干字节记录一条,
+描述日志文件中一段 [begin, end) 内所有日志时间的最小值和最大值
+日志在文件中并不一定按时间排序(多线程下获取时间与加锁写文件之间有间隔, collector 依次写出各个进程积压的日志),
+因此读取端不二分查找, 而是选出时间范围与查询有交集的所有区间, 只读取这些区间, 再按每条日志的 time 字段精确过滤
+索引没有覆盖的部分(例如进程崩溃时尚未写出的最后一个区间)总是会被读取
+写入端只在一个区间结束时写出 32 字节并 flush, 均摊到每条日志上的开销可以忽略
+*/
+
+namespace structlog {
+
+struct TimeIndexEntry {
+  uint64_t min_time;  // unix 时间, 纳秒
+  uint64_t max_time;
+  uint64_t begin;     // 区间在日志文件中的偏移 [begin, end)
+  uint64_t end;
+};
+
+class TimeIndexWriter {
+ public:
+  TimeIndexWriter() : f_(nullptr), every_records_(0), every_bytes_(0), records_(0) {}
+  ~TimeIndexWriter() { Close(); }
+  TimeIndexWriter(const TimeIndexWriter&) = delete;
+  TimeIndexWriter& operator=(const TimeIndexWriter&) = delete;
+
+  // 以追加方式打开 log_path 对应的索引文件, 每 every_records 条日志或 every_bytes 字节(先到者)记录一条索引, 0 表示不限
+  // log_size 为日志文件当前的长度, 已有索引超出该长度时(日志被截断过)清空索引重新生成
+  bool Open(const std::string& log_path, uint64_t log_size, std::size_t every_records, std::size_t every_bytes);
+  // 写出当前未结束的区间并关闭
+  void Close();
+  bool is_open() const { return f_ != nullptr; }
+
+  // 每写入一段日志调用一次, offset 为这段日志在文件中的位置, n 为其长度, 其中包含 records 条时间为 time 的日志
+  void Add(uint64_t time, uint64_t offset, uint64_t n, std::size_t records = 1) {
+    if (records_ && (records_ >= every_records_ || offset - entry_.begin >= every_bytes_))
+      Finish();
+    if (!records_) {
+      entry_.min_time = entry_.max_time = time;
+      entry_.begin = offset;
+    }
+    entry_.min_time = std::min(entry_.min_time, time);
+    entry_.max_time = std::max(entry_.max_time, time);
+    entry_.end = offset + n;
+    records_ += records;
+  }
+
+ private:
+  void Finish();
+
+  FILE* f_;
+  std::size_t every_records_;
+  uint64_t every_bytes_;
+  std::size_t records_;  // 当前区间内的日志条数, 0 表示没有未结束的区间
+  TimeIndexEntry entry_;
+};
+
+// 返回 log_path 对应的索引文件路径
+std::string TimeIndexPath(const std::string& log_path);
+
+// 读取 log_path 的索引, 索引不存在时返回空, 末尾不完整的项被忽略
+std::vector<TimeIndexEntry> ReadTimeIndex(const std::string& log_path);
+
+// 将 log_path 中 time 字段在 [begin, end] 之间的日志按文件中的顺序写到 out, 返回写出的条数, 没有索引时退化为扫描整个文件
+// 超出日志长度的索引项, 以及偏移回退(日志被截断后重新写入)之前的索引项都被忽略
+std::size_t CopyTimeRange(const std::string& log_path, uint64_t begin, uint64_t end, std::ostream& out);
+
+// 解析日志中 time 字段的格式 "2022-04-26T12:59:39.014038213+08:00" 为纳秒 unix 时间
+// 小数部分可以省略或少于 9 位, 时区可以是 Z/+HH:MM/-HH:MM, 省略时区视为 +08:00
+bool ParseTime(const char* s, std::size_t n, uint64_t& time);
+
+}  // namespace structlog